@@ -73,10 +73,20 @@ static slab *slab_new(heritage *h);
 static void slab_ref_down(slab *s);
 static cnt slab_max_blocks(const slab *s);
 
-static block *alloc_from_slab(slab *s, heritage *h);
+static void *linalloc_z(heritage *h, bool *zero);
+static block *alloc_from_slab(slab *s, heritage *h, bool *zero);
 static bool slab_fully_hot(const slab *s);
 static err recover_hot_blocks(slab *s);
-static bool fills_slab(cnt blocks, size bs);
+static bool fills_slab(cnt blocks, size bs, size room);
+static size slab_room(const slab *s);
+
+static block *alloc_from_bits(slab *s);
+static err recover_hot_bits(slab *s);
+static cnt harvest_hot_bits(slab *s);
+static void linfree_bits(slab *s, block *b);
+static iptr bits_first(const uptr *map, idx w);
+static uptr *local_map_of(const slab *s);
+static volatile uptr *hot_map_of(const slab *s);
 
 static slab *slab_of(const block *b);
 static u8 *blocks_of(slab *s);
@@ -89,8 +99,10 @@ static void profile_upd_alloc(size s);
 
 #define slab_new(as...) trace(NALLOC, 2, slab_new, as)
 #define slab_ref_down(as...) trace(NALLOC, LINREF_VERB, slab_ref_down, as)
+#define linfree_bits(as...) trace(NALLOC, 2, linfree_bits, as)
 
 lfstack shared_free_slabs = LFSTACK;
+lfstack shared_free_bitmap_slabs = LFSTACK;
 
 dbg iptr slabs_in_use;
 dbg iptr total_slabs_used;
@@ -105,11 +117,16 @@ static const type malloctypes[] = { MAP(MALLOC_TYPE, _,
 };
 
 #define MALLOC_HERITAGE(i, ...)                 \
-    HERITAGE(&malloctypes[i], 32, 1, new_slabs)
+    HERITAGE(&malloctypes[i], 32, 1, new_slabs, NEW_SLABS_ZEROED)
 static heritage malloc_heritages[] = {
     ITERATE(MALLOC_HERITAGE, _, 14)
 };
 
+void *(linalloc)(heritage *h){
+    bool zero;
+    return (linalloc_z)(h, &zero);
+}
+
 /* Fetch a slab s from h->slabs or else allocate a new one. Since all
    slabs on h->slabs must contain a free block, it must be possible to
    allocate from s in both cases.
@@ -126,8 +143,11 @@ static heritage malloc_heritages[] = {
    will be returned only to s->hot_blocks. If s->contig_blocks and
    s->local_blocks are empty, then s is empty iff s->hot_blocks is
    empty. A single CAS suffices to mark s->hot_blocks lost iff it's empty.
+
+   Also sets *zero iff every byte of ret is known to be 0.
 */
-void *(linalloc)(heritage *h){
+static
+void *(linalloc_z)(heritage *h, bool *zero){
     if(poisoned())
         return NULL;
     
@@ -135,7 +155,7 @@ void *(linalloc)(heritage *h){
     if(!s && !(s = slab_new(h)))
         return EOOR(), NULL;
 
-    block *b = alloc_from_slab(s, h);
+    block *b = alloc_from_slab(s, h, zero);
     if(!slab_fully_hot(s) || !recover_hot_blocks(s))
         lfstack_push(&s->sanc, &h->slabs);
     else
@@ -153,17 +173,41 @@ void *(linalloc)(heritage *h){
    as does linfree(). Luckily, it's easy to preserve this because it's
    optimal to clear out s->hot_blocks when checking for emptiness in
    recover_hot_blocks().
+
+   Blocks in s->contig_blocks are all zero iff s->contig_zero. Freed blocks
+   may have been written, so the rest are assumed dirty.
 */
 static
-block *(alloc_from_slab)(slab *s, heritage *h){
+block *(alloc_from_slab)(slab *s, heritage *h, bool *zero){
+    *zero = s->contig_blocks && s->contig_zero;
     if(s->contig_blocks)
         return (void *) &blocks_of(s)[h->t->size * --s->contig_blocks];
+    if(s->block_bitmap)
+        return alloc_from_bits(s);
     return mustp(cof(stack_pop(&s->local_blocks), block, sanc));
 }
 
+/* Take the lowest block in local_map_of(s). Since finding it didn't touch
+   block memory, prefetch the next one for whoever allocates it. */
+static
+block *(alloc_from_bits)(slab *s){
+    uptr *map = local_map_of(s);
+    iptr i = bits_first(map, 0);
+    must(i >= 0);
+    map[i / WORDBITS] &= ~((uptr) 1 << i % WORDBITS);
+    iptr n = bits_first(map, i / WORDBITS);
+    if(n >= 0)
+        __builtin_prefetch(&blocks_of(s)[MIN_ALIGN * n], 1);
+    return (void *) &blocks_of(s)[MIN_ALIGN * i];
+}
+
 static
 bool slab_fully_hot(const slab *s){
-    return !s->contig_blocks && !stack_peek(&s->local_blocks);
+    if(s->contig_blocks)
+        return false;
+    if(s->block_bitmap)
+        return bits_first(local_map_of(s), 0) < 0;
+    return !stack_peek(&s->local_blocks);
 }
 
 typedef struct{
@@ -173,6 +217,8 @@ typedef struct{
 
 static
 err (recover_hot_blocks)(slab *s){
+    if(s->block_bitmap)
+        return recover_hot_bits(s);
     assert(!PUN(hotst, lfstack_gen(&s->hot_blocks)).lost);
     struct lfstack h = lfstack_read(&s->hot_blocks);
     while(!lfstack_clear_cas_won((hotst){.lost = !lfstack_peek(&h)},
@@ -231,11 +277,15 @@ err (recover_hot_blocks)(slab *s){
 */
 void (linfree)(lineage *l){
     block *b = l;
-    *b = (block){SANCHOR};
-
     slab *s = slab_of(b);
     heritage *her = s->her;
     assert(profile_upd_free(s->tx.t->size), 1);
+    if(s->block_bitmap){
+        linfree_bits(s, b);
+        return;
+    }
+
+    *b = (block){SANCHOR};
     
     for(struct lfstack h = lfstack_read(&s->hot_blocks);;){
         hotst st = PUN(hotst, lfstack_gen(&h));
@@ -243,10 +293,11 @@ void (linfree)(lineage *l){
             if(!lfstack_push_cas_won(&l->sanc, rup(st, .size++),
                                      &s->hot_blocks, &h))
                 continue;
-            if(fills_slab(st.size + 1, s->tx.t->size)){
+            if(fills_slab(st.size + 1, s->tx.t->size, MAX_BLOCK)){
                 assert(!stack_peek(&s->local_blocks));
                 
                 s->contig_blocks = st.size + 1;
+                s->contig_zero = false;
                 s->hot_blocks = (lfstack) LFSTACK;
                 slab_ref_down(s);
             }
@@ -264,11 +315,152 @@ void (linfree)(lineage *l){
     lfstack_push(&s->sanc, &her->slabs);
 }
 
+/* Bitmap heritages keep the protocol above, with hot_map_of(s) standing in
+   for the blocks on s->hot_blocks. s->hot_blocks.gen still holds the lost
+   flag and a count, but the count is now signed.
+
+   linfree_bits() sets b's bit before counting it, so that a slab which
+   the count says is full really is. recover_hot_bits() may harvest the
+   bit in between. So the count is the number of counted but unharvested
+   blocks minus the number of harvested but uncounted ones, and it can be
+   negative whether or not s is lost. For instance, the owner may harvest
+   the bits of two frees which have yet to count.
+
+   A slab is only marked lost when its count is <= 0, and nothing harvests
+   from a lost slab. Frees onto a lost slab with a negative count just
+   count: their blocks may already have been harvested and handed out.
+
+   The linfree_bits() A which finds s lost with a count of 0 clears s->lost
+   without counting b, like linfree(). Either:
+   - b's bit is still in hot_map_of(s), uncounted.
+   - OR b's bit was harvested before s was marked lost. Then b contributes
+     -1 to the count, so for the count to be 0 there must be a block which
+     was counted but not harvested, and its bit is in hot_map_of(s).
+   In both cases, hot_map_of(s) is non-empty. And in both cases the count
+   stays below the number of blocks in s until A accounts for b, so no
+   other linfree_bits() can fill s in the meantime.
+
+   If returning s to its heritage, A harvests hot_map_of(s) so that s has a
+   free local block, and then adjusts the count for both b and the
+   harvest. Otherwise, it counts b like a normal linfree_bits().
+*/
+typedef struct{
+    uptr lost:1;
+    iptr size:WORDBITS - 1;
+} bitst;
+
+static
+void (linfree_bits)(slab *s, block *b){
+    heritage *her = s->her;
+    idx i = (idx) ((u8 *) b - blocks_of(s)) / MIN_ALIGN;
+    __atomic_fetch_or(&hot_map_of(s)[i / WORDBITS], (uptr) 1 << i % WORDBITS,
+                      __ATOMIC_SEQ_CST);
+
+    for(struct lfstack h = lfstack_read(&s->hot_blocks);;){
+        bitst st = PUN(bitst, lfstack_gen(&h));
+        assert(!st.lost || st.size <= 0);
+        if(!st.lost || st.size < 0){
+            if(!lfstack_clear_cas_won(rup(st, .size++), &s->hot_blocks, &h))
+                continue;
+            if(!st.lost && st.size + 1 > 0
+               && fills_slab(st.size + 1, s->tx.t->size, slab_room(s)))
+            {
+                assert(bits_first(local_map_of(s), 0) < 0);
+                for(idx w = 0; w < BLOCK_MAP_WORDS; w++)
+                    hot_map_of(s)[w] = 0;
+                s->contig_blocks = st.size + 1;
+                s->contig_zero = false;
+                s->hot_blocks = (lfstack) LFSTACK;
+                slab_ref_down(s);
+            }
+            return;
+        }else if(!lfstack_clear_cas_won((bitst){}, &s->hot_blocks, &h))
+            continue;
+
+        if(xadd_iff_less(1, &her->nslabs, her->max_slabs) < her->max_slabs)
+            break;
+        h = (lfstack) LFSTACK;
+    }
+
+    cnt got = must(harvest_hot_bits(s));
+    for(struct lfstack h = lfstack_read(&s->hot_blocks);;){
+        bitst st = PUN(bitst, lfstack_gen(&h));
+        if(lfstack_clear_cas_won(rup(st, .size = st.size + 1 - (iptr) got),
+                                 &s->hot_blocks, &h))
+            break;
+    }
+    lfstack_push(&s->sanc, &her->slabs);
+}
+
+/* Like recover_hot_blocks(). Bits are set before they're counted, so if
+   the count is positive, a harvest must find something. */
+static
+err (recover_hot_bits)(slab *s){
+    assert(!PUN(bitst, lfstack_gen(&s->hot_blocks)).lost);
+    struct lfstack h = lfstack_read(&s->hot_blocks);
+    for(cnt got = harvest_hot_bits(s);;){
+        bitst st = PUN(bitst, lfstack_gen(&h));
+        if(!got && st.size > 0)
+            must(got = harvest_hot_bits(s));
+        if(lfstack_clear_cas_won((bitst){.lost = !got,
+                                         .size = st.size - (iptr) got},
+                                 &s->hot_blocks, &h))
+            return got ? 0 : EARG;
+    }
+}
+
+/* Move every bit in hot_map_of(s) to local_map_of(s) and return how
+   many there were. Only the thread with exclusive access to
+   local_map_of(s) may do this. */
+static
+cnt harvest_hot_bits(slab *s){
+    cnt got = 0;
+    volatile uptr *hot = hot_map_of(s);
+    uptr *local = local_map_of(s);
+    for(idx w = 0; w < BLOCK_MAP_WORDS; w++){
+        if(!hot[w])
+            continue;
+        uptr m = __atomic_exchange_n(&hot[w], 0, __ATOMIC_SEQ_CST);
+        local[w] |= m;
+        got += __builtin_popcountl(m);
+    }
+    return got;
+}
+
+/* Index of the lowest set bit in map at or above word w, or -1. */
+static
+iptr bits_first(const uptr *map, idx w){
+    for(; w < BLOCK_MAP_WORDS; w++){
+        uptr m = map[w];
+        if(m)
+            return w * WORDBITS + __builtin_ctzl(m);
+    }
+    return -1;
+}
+
+/* Only the thread with exclusive access to s allocates from or harvests
+   into its local map, so it isn't volatile. */
+static
+uptr *local_map_of(const slab *s){
+    return (uptr *) &s->blocks[MAX_BITMAP_BLOCK];
+}
+
+static
+volatile uptr *hot_map_of(const slab *s){
+    return (volatile uptr *) &s->blocks[MAX_BLOCK - BLOCK_MAP_BYTES];
+}
+
 /* Avoids division. Subtracts bs to handle padding between last block and
-   footer. */
-static bool fills_slab(cnt blocks, size bs){
-    assert(blocks * bs <= MAX_BLOCK);
-    return blocks * bs > MAX_BLOCK - bs;
+   footer. room is slab_room() of the slab. */
+static bool fills_slab(cnt blocks, size bs, size room){
+    assert(blocks * bs <= room);
+    return blocks * bs > room - bs;
+}
+
+/* Bytes of s->blocks available to blocks. */
+static
+size slab_room(const slab *s){
+    return s->block_bitmap ? MAX_BITMAP_BLOCK : MAX_BLOCK;
 }
 
 static
@@ -279,17 +471,23 @@ heritage *malloc_heritage_of(size size){
     EWTF("Size is assumed < MAX_BLOCK, but ");
 }
 
-void *(malloc)(size size){
+static
+void *malloc_z(size size, bool *zero){
     if(!size)
         return TODO(), NULL;
     if(size > MAX_BLOCK)
         return TODO(), NULL;
-    block *b = (linalloc)(malloc_heritage_of(size));
-    if(b)
+    block *b = (linalloc_z)(malloc_heritage_of(size), zero);
+    if(b && !*zero)
         assertl(2, magics_valid(b, malloc_heritage_of(size)->t->size));
     return b;
 }
 
+void *(malloc)(size size){
+    bool zero;
+    return malloc_z(size, &zero);
+}
+
 void (free)(void *b){
     lineage *l = (lineage *) b;
     if(!b)
@@ -306,6 +504,14 @@ void (free)(void *b){
    slab-oriented, so h->lin_init() sets up "type invariants" on all blocks
    before linref_up() is allowed to succeed on the slab. This could be
    avoided through careful use of contig_blocks, but I don't do this.
+
+   s->contig_zero starts out as h->new_slabs_zeroed and is cleared as soon
+   as anything writes to s's blocks. Slabs only reach h->free_slabs after
+   every block has been freed, so recycled slabs are always dirty.
+
+   s->block_bitmap is set once, when s is mapped. Bitmap heritages have
+   their own free slabs, so s never changes modes. Otherwise, a slab
+   keeping its type would have to overwrite live lineages with maps.
 */
 static
 slab *(slab_new)(heritage *h){
@@ -318,24 +524,37 @@ slab *(slab_new)(heritage *h){
         assert(aligned_pow2(s, SLAB_SIZE));
         
         s->slabfooter = (slabfooter) SLABFOOTER;
+        s->contig_zero = h->new_slabs_zeroed;
+        s->block_bitmap = h->block_bitmap;
         for(slab *si = s + 1; si != &s[h->slab_alloc_batch]; si++){
             si->slabfooter = (slabfooter) SLABFOOTER;
+            si->contig_zero = h->new_slabs_zeroed;
+            si->block_bitmap = h->block_bitmap;
             lfstack_push(&si->sanc, h->free_slabs);
         }
     }
     assert(xadd(1, &slabs_in_use) >= 0);
     assert(!s->tx.linrefs);
     assert(!lfstack_peek(&s->hot_blocks));
+    assert(s->block_bitmap == h->block_bitmap);
+    assert(s->tx.t != h->t || !s->block_bitmap
+           || (bits_first(local_map_of(s), 0) < 0
+               && bits_first((const uptr *) hot_map_of(s), 0) < 0));
     
     s->her = h;
     if(s->tx.t != h->t){
         s->tx = (tyx){h->t};
         
+        if(s->block_bitmap)
+            for(idx w = 0; w < BLOCK_MAP_WORDS; w++)
+                local_map_of(s)[w] = hot_map_of(s)[w] = 0;
         cnt nb = s->contig_blocks = slab_max_blocks(s);
-        if(h->t->lin_init)
+        assert(nb);
+        if(h->t->lin_init){
+            s->contig_zero = false;
             for(cnt b = 0; b < nb; b++)
                 h->t->lin_init((void *) &blocks_of(s)[b * h->t->size]);
-        else
+        }else if(!s->contig_zero)
             for(cnt b = 0; b < nb; b++)
                 assertl(2, write_magics((block *) &blocks_of(s)[b * h->t->size],
                                         h->t->size));
@@ -384,7 +603,7 @@ void (linref_down)(const volatile void *l, type *t){
 
 static
 cnt slab_max_blocks(const slab *s){
-    return MAX_BLOCK / s->tx.t->size;
+    return slab_room(s) / s->tx.t->size;
 }
 
 static constfun 
@@ -407,10 +626,16 @@ void (sfree)(void *b, size size){
     (free)(b);
 }
 
+/* Blocks are at most MAX_BLOCK bytes and about to be used, so plain
+   memset() beats non-temporal stores here. */
 void *(calloc)(size nb, size bs){
-    u8 *b = (malloc)(nb * bs);
-    if(b)
-        memset(b, 0, nb * bs);
+    size sz;
+    if(__builtin_mul_overflow(nb, bs, &sz))
+        return EOOR(), NULL;
+    bool zero;
+    u8 *b = malloc_z(sz, &zero);
+    if(b && !zero)
+        memset(b, 0, sz);
     return b;
 }
 
@@ -28,6 +28,13 @@ typedef const struct type{
 } type;
 #define TYPE(t, li, hsr) {#t, sizeof(t), li, hsr}
 
+/* Define as 1 if new_slabs() hands out fresh anonymous mappings, or
+   otherwise zero-filled memory. calloc() then skips zeroing blocks from
+   fresh slabs. */
+#ifndef NEW_SLABS_ZEROED
+#define NEW_SLABS_ZEROED 0
+#endif
+
 typedef struct heritage{
     lfstack slabs;
     lfstack *free_slabs;
@@ -36,11 +43,25 @@ typedef struct heritage{
     cnt slab_alloc_batch;
     type *t;
     struct slab *(*new_slabs)(cnt nslabs);
+    /* new_slabs() returns zero-filled memory. */
+    bool new_slabs_zeroed;
+    /* Track free blocks in bitmaps at the end of each slab rather than
+       lists threaded through the blocks. nalloc then never writes to a
+       lineage between linfree() and linalloc(), not even its lowest
+       word. Costs a few blocks per slab.
+
+       Slabs never change modes, so free_slabs must only be shared with
+       other bitmap heritages. */
+    bool block_bitmap;
 } heritage;
 #define HERITAGE(t, ms, sab, ns, override...)       \
     {LFSTACK, &shared_free_slabs, 0, ms, sab, t, ns, override}
-#define KERN_HERITAGE(t) HERITAGE(t, 16, 2, new_slabs)
+#define KERN_HERITAGE(t) HERITAGE(t, 16, 2, new_slabs, NEW_SLABS_ZEROED)
 #define POSIX_HERITAGE(t) KERN_HERITAGE(t)
+/* t->size must be at most MAX_BITMAP_BLOCK. */
+#define BITMAP_HERITAGE(t)                                              \
+    {LFSTACK, &shared_free_bitmap_slabs, 0, 16, 2, t, new_slabs,        \
+     NEW_SLABS_ZEROED, true}
 
 typedef struct tyx tyx;
 
@@ -52,6 +73,8 @@ typedef volatile struct slabfooter{
     sanchor sanc;
     stack local_blocks;
     cnt contig_blocks;
+    bool contig_zero;
+    bool block_bitmap;
     heritage *volatile her;
     align(CACHELINE_SIZE)
     lfstack hot_blocks;
@@ -59,6 +82,16 @@ typedef volatile struct slabfooter{
 #define SLABFOOTER {.local_blocks = STACK, .hot_blocks = LFSTACK}
 #define MAX_BLOCK (SLAB_SIZE - sizeof(slabfooter))
 
+/* Bitmap slabs keep two maps on separate cache lines at the end of
+   s->blocks. There's one bit per MIN_ALIGN bytes of blocks, so that bit
+   indices are shifts rather than divisions by the block size. */
+#define BLOCK_MAP_WORDS                                         \
+    ((MAX_BLOCK / MIN_ALIGN + WORDBITS - 1) / WORDBITS)
+#define BLOCK_MAP_BYTES                                         \
+    ((BLOCK_MAP_WORDS * sizeof(uptr) + CACHELINE_SIZE - 1)      \
+     & ~(CACHELINE_SIZE - 1))
+#define MAX_BITMAP_BLOCK (MAX_BLOCK - 2 * BLOCK_MAP_BYTES)
+
 typedef struct align(SLAB_SIZE) slab{
     u8 blocks[MAX_BLOCK];
     union{
@@ -72,6 +105,7 @@ typedef struct align(SLAB_SIZE) slab{
 #define MIN_ALIGN (sizeof(lineage))
 
 extern lfstack shared_free_slabs;
+extern lfstack shared_free_bitmap_slabs;
 
 dbg extern iptr slabs_used;
 dbg extern cnt bytes_used;
@@ -101,7 +135,8 @@ void linfree(lineage *l);
      - For any void *p | in_obj(o, p, t->size):
        - !linref_up(p, t') iff t' == t.
      - t->lin_init(o) returned and no nalloc function subsequently wrote
-       to memory between o + sizeof(lineage) and o + t->size.
+       to memory between o + sizeof(lineage) and o + t->size. If h is a
+       block_bitmap heritage, nalloc didn't write to o at all.
    - OR !t->has_special_ref(l, true)
 
    If ret, linfree(o) must have completed for similarly defined o.